@@ -23,6 +23,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <limits.h>
+#include <linux/falloc.h>
 
 //size of a disk block
 #define	BLOCK_SIZE 512
@@ -45,6 +49,9 @@
 #define PATH_SUB  2
 #define PATH_FILE 3
 
+// One bit per file in a directory
+#define FILE_BITMAP_SIZE (MAX_FILES_IN_DIR + 7) / 8
+
 //The attribute packed means to not align these things
 struct cs1550_directory_entry
 {
@@ -59,9 +66,11 @@ struct cs1550_directory_entry
 		long nStartBlock;								//where the first block is on disk
 	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
 
+	unsigned char mapped[FILE_BITMAP_SIZE];		//Bit i set if files[i] is stored through a run map
+
 	//This is some space to get this to be exactly the size of the disk block.
 	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int) - FILE_BITMAP_SIZE];
 } ; typedef struct cs1550_directory_entry cs1550_directory_entry;
 
 #define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
@@ -84,7 +93,7 @@ struct cs1550_root_directory
 //How much data can one block hold?
 #define	MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(long))
 
-#define START_FILES 1 + MAX_DIRS_IN_ROOT
+#define START_FILES (1 + MAX_DIRS_IN_ROOT)
 
 struct cs1550_disk_block
 {
@@ -103,6 +112,119 @@ struct cs1550_file_alloc_table_block {                          // Define FAT bl
     short table[MAX_FAT_ENTRIES];
 }; typedef struct cs1550_file_alloc_table_block cs1550_fat_block;
 
+// Mapped files keep a run map in their first block instead of a single FAT
+// chain. Each map entry is a run: a range of logical blocks stored in its own
+// FAT chain. Blocks no run covers are holes and read as zeros, so holes take
+// neither disk blocks nor map entries. A map block holds MAX_RUNS_IN_MAP runs;
+// longer maps carry on in more blocks linked through nNextBlock, each taken
+// from the FAT like any other block.
+//
+// Compressed maps use runs of exactly RUN_BLOCKS logical blocks, compressed as
+// a unit, so a read only decompresses the run covering its offset. Plain files
+// switch to an uncompressed map (MAP_NOCOMPRESS) the first time they need a
+// hole. There a run is an extent of up to MAX_EXTENT_BLOCKS blocks that are
+// read and written in place one block at a time, and only blocks holding data
+// are allocated.
+#define RUN_BLOCKS 8
+#define RUN_SIZE (RUN_BLOCKS * MAX_DATA_IN_BLOCK)
+#define MAX_EXTENT_BLOCKS 128
+
+// Largest size a mapped file can reach, as far as a run's nFirst can count
+#define MAX_MAPPED_SIZE ((off_t) INT_MAX * MAX_DATA_IN_BLOCK)
+
+struct cs1550_run
+{
+	int nFirst;					//First logical block covered by the run
+	short nStartBlock;			//FAT index of the first block of the run
+	unsigned short nLength;		//Logical bytes covered by the run
+	unsigned short nStored;		//Bytes on disk, equal to nLength if stored uncompressed
+} __attribute__((packed));
+
+#define MAX_RUNS_IN_MAP ((MAX_DATA_IN_BLOCK - sizeof(int) - 1) / sizeof(struct cs1550_run))
+
+struct cs1550_map_block
+{
+	long nNextBlock;	//Next block of the run map, 0 if this is the last one
+
+	int nRuns;			//How many runs are in use in this block
+
+	struct cs1550_run runs[MAX_RUNS_IN_MAP];
+
+	unsigned char nFlags;	//Map flags (MAP_NOCOMPRESS), only read from the first block
+
+	char padding[BLOCK_SIZE - sizeof(long) - sizeof(int) - MAX_RUNS_IN_MAP * sizeof(struct cs1550_run) - 1];
+}; typedef struct cs1550_map_block cs1550_map_block;
+
+// Every run holds at least one block, so a map never has more runs than the FAT has entries
+#define MAX_RUNS FAT_LENGTH
+#define MAX_MAP_BLOCKS ((MAX_RUNS + MAX_RUNS_IN_MAP - 1) / MAX_RUNS_IN_MAP)
+
+// The whole run map of a file, as it's kept in memory
+struct cs1550_run_map
+{
+	int nRuns;							//How many runs are in use, sorted by nFirst
+	unsigned char nFlags;				//Map flags (MAP_NOCOMPRESS)
+	int nBlocks;						//How many map blocks the runs are spread over
+	long nBlock[MAX_MAP_BLOCKS];		//Where each map block is on disk, the first is the file's first block
+	struct cs1550_run runs[MAX_RUNS];
+}; typedef struct cs1550_run_map cs1550_run_map;
+
+// Map Flags
+#define MAP_NOCOMPRESS 0x01	// Runs are uncompressed extents, the map is only there for holes
+
+// Decompressed run cache
+#define RUN_CACHE_SLOTS 16
+
+struct cs1550_run_cache_slot
+{
+	long nFileBlock;	//First block of the cached file, 0 if the slot is empty
+	int nRun;			//Which run of the file is cached
+	char data[RUN_SIZE];
+};
+
+static struct cs1550_run_cache_slot run_cache[RUN_CACHE_SLOTS];
+static pthread_mutex_t run_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-file generation counters, indexed by the FAT index of the file's first block.
+// Writes and truncates bump the generation, and open only lets the kernel keep
+// its page cache if the generation hasn't moved since the previous open.
+static unsigned int file_generation[FAT_LENGTH];
+static unsigned int open_generation[FAT_LENGTH];
+static pthread_mutex_t generation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Mount options. Compression is picked per directory with compress_dirs
+// (e.g. -o compress_dirs=logs:tmp) rather than an extended attribute: once
+// getxattr is implemented, the kernel asks it for security.capability before
+// every write, which is one more round trip to us per write(2).
+struct cs1550_config
+{
+	int compress;			//Create every new file compressed
+	char* compress_dirs;	//Directories whose new files are compressed, separated by ':'
+	int keep_cache;			//Keep the kernel page cache across opens of unchanged files
+	unsigned int io_size;	//max_read/max_write/max_readahead in bytes
+};
+
+// Bounds for io_size. libfuse 2 can't take writes bigger than 128K.
+#define IO_SIZE_MIN 4096
+#define IO_SIZE_MAX (128 * 1024)
+
+static struct cs1550_config config = {
+	.keep_cache = 1,
+	.io_size = IO_SIZE_MAX,
+};
+
+#define CS1550_OPT(t, p, v) { t, offsetof(struct cs1550_config, p), v }
+
+static struct fuse_opt cs1550_opts[] = {
+	CS1550_OPT("compress", compress, 1),
+	CS1550_OPT("nocompress", compress, 0),
+	CS1550_OPT("compress_dirs=%s", compress_dirs, 0),
+	CS1550_OPT("keep_cache", keep_cache, 1),
+	CS1550_OPT("nokeep_cache", keep_cache, 0),
+	CS1550_OPT("io_size=%u", io_size, 0),
+	FUSE_OPT_END
+};
+
 
 // Loads root into a struct
 static cs1550_root_directory* load_root()
@@ -229,6 +351,1053 @@ static void save_fat(short* fat)
     fclose(file);                                       // Close disk
 }
 
+// Loads the run map of a mapped file, following it through all of its blocks
+static cs1550_run_map* load_map(long nStartBlock)
+{
+    cs1550_run_map* map = calloc(1, sizeof(cs1550_run_map));   // Allocate space for the run map
+    cs1550_map_block block;
+    long nBlock = nStartBlock;
+    FILE* file = fopen(".disk", "rb");                          // Open disk
+    if(file)
+    {
+        while(nBlock != 0 && map->nBlocks < MAX_MAP_BLOCKS)         // Until we run out of map blocks
+        {
+            fseek(file, nBlock * BLOCK_SIZE, SEEK_SET);                 // Seek to the map block
+            fread(&block, sizeof(cs1550_map_block), 1, file);           // Read it from disk
+            if(map->nBlocks == 0) map->nFlags = block.nFlags;
+            if(block.nRuns > MAX_RUNS_IN_MAP || map->nRuns + block.nRuns > MAX_RUNS) break;
+            memcpy(&map->runs[map->nRuns], block.runs, block.nRuns * sizeof(struct cs1550_run));
+            map->nRuns += block.nRuns;
+            map->nBlock[map->nBlocks++] = nBlock;
+            nBlock = block.nNextBlock;
+        }
+        fclose(file);                                               // Close disk
+    }
+    if(map->nBlocks == 0) map->nBlock[map->nBlocks++] = nStartBlock;
+    return map;
+}
+
+// Saves the run map of a mapped file to the disk, filling its map blocks in order
+static void save_map(cs1550_run_map* map, long nStartBlock)
+{
+    cs1550_map_block block;
+    int i;
+
+    map->nBlock[0] = nStartBlock;
+    FILE* file = fopen(".disk", "r+b");                         // Open disk
+    for(i = 0; i < map->nBlocks; i++)                           // For every map block
+    {
+        int first = i * MAX_RUNS_IN_MAP;
+        memset(&block, 0, sizeof(cs1550_map_block));
+        block.nNextBlock = i + 1 < map->nBlocks ? map->nBlock[i + 1] : 0;
+        block.nRuns = map->nRuns - first;
+        if(block.nRuns > MAX_RUNS_IN_MAP) block.nRuns = MAX_RUNS_IN_MAP;
+        if(block.nRuns < 0) block.nRuns = 0;
+        memcpy(block.runs, &map->runs[first], block.nRuns * sizeof(struct cs1550_run));
+        block.nFlags = map->nFlags;
+        fseek(file, map->nBlock[i] * BLOCK_SIZE, SEEK_SET);         // Seek to the map block
+        fwrite(&block, 1, sizeof(cs1550_map_block), file);          // Write it to disk
+    }
+    fclose(file);                                               // Close disk
+}
+
+// Checks whether a file in a directory is stored through a run map
+static int is_mapped(cs1550_directory_entry* dir, int fileIndex)
+{
+    return (dir->mapped[fileIndex / 8] >> (fileIndex % 8)) & 1;
+}
+
+// Marks a file in a directory as stored through a run map (or not)
+static void set_mapped(cs1550_directory_entry* dir, int fileIndex, int on)
+{
+    if(on) dir->mapped[fileIndex / 8] |= 1 << (fileIndex % 8);
+    else   dir->mapped[fileIndex / 8] &= ~(1 << (fileIndex % 8));
+}
+
+// Checks whether new files in a directory are created compressed
+static int compress_dir(const char* directory)
+{
+    const char* p = config.compress_dirs;
+    size_t n = strlen(directory);
+
+    if(config.compress) return 1;
+    while(p != NULL && *p != '\0')                     // For every name in the list
+    {
+        const char* end = strchr(p, ':');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        if(len == n && strncmp(p, directory, n) == 0) return 1;
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+// Writes an empty run map into the first block of a file
+static void init_map(long nStartBlock, int nFlags)
+{
+    cs1550_run_map* map = calloc(1, sizeof(cs1550_run_map));    // No runs yet
+    map->nFlags = nFlags;
+    map->nBlocks = 1;
+    save_map(map, nStartBlock);
+    free(map);
+}
+
+// Frees every block of a FAT chain starting at index k
+static void free_chain(short* fat, int k)
+{
+    int next;
+    while(k >= 0)                   // Until we fall off the end of the chain
+    {
+        next = fat[k];                  // Save index of next block
+        fat[k] = 0;                     // Set current block to unused
+        k = next;                       // Move to next block
+    }
+}
+
+// Counts the blocks in a FAT chain starting at index k
+static int chain_length(short* fat, int k)
+{
+    int n = 0;
+    while(k >= 0)
+    {
+        n++;
+        k = fat[k];
+    }
+    return n;
+}
+
+// Counts the unused entries in our fat
+static int count_empty_fat_indexes(short* fat)
+{
+    int i, n = 0;
+    for(i = 0; i < FAT_LENGTH; i++)
+    {
+        if(fat[i] == 0) n++;
+    }
+    return n;
+}
+
+/*
+ * LZ77 codec used for compressed files, bitstream compatible with LZF.
+ *
+ * A control byte below 32 starts a run of (ctrl + 1) literal bytes. Otherwise
+ * the top 3 bits hold the match length - 2 (7 means an extra length byte
+ * follows) and the low 5 bits plus the next byte hold the distance - 1.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_HASH(p) ((((p)[0] << 16 | (p)[1] << 8 | (p)[2]) * 2654435761u) >> (32 - LZ_HASH_BITS))
+#define LZ_MAX_LIT (1 << 5)
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF ((1 << 8) + (1 << 3))
+
+// Compresses in_len bytes into out, returns compressed length or 0 if it doesn't fit in out_len
+static int lz_compress(const unsigned char* in, int in_len, unsigned char* out, int out_len)
+{
+    int htab[1 << LZ_HASH_BITS];
+    int ip = 0, op = 0, lit = 0, lit_pos;
+
+    memset(htab, 0xff, sizeof(htab));           // Every hash slot starts empty (-1)
+
+    if(op >= out_len) return 0;
+    lit_pos = op++;                             // Reserve control byte for the first literal run
+
+    while(ip < in_len)
+    {
+        int ref = -1;
+        if(ip < in_len - 2)                     // Need 3 bytes to look for a match
+        {
+            unsigned h = LZ_HASH(in + ip);
+            ref = htab[h];
+            htab[h] = ip;
+        }
+
+        int off = ip - ref - 1;
+        if(ref >= 0 && off < LZ_MAX_OFF
+           && in[ref] == in[ip] && in[ref + 1] == in[ip + 1] && in[ref + 2] == in[ip + 2])
+        {
+            int max = in_len - ip;
+            int len = 3;
+            if(max > LZ_MAX_REF) max = LZ_MAX_REF;
+            while(len < max && in[ref + len] == in[ip + len]) len++;
+
+            if(lit) out[lit_pos] = lit - 1;     // Close the pending literal run
+            else op--;                          // Or drop its unused control byte
+
+            if(op + 3 + 1 > out_len) return 0;  // Back reference plus the next control byte
+            len -= 2;
+            if(len < 7)
+                out[op++] = (len << 5) | (off >> 8);
+            else
+            {
+                out[op++] = (7 << 5) | (off >> 8);
+                out[op++] = len - 7;
+            }
+            out[op++] = off & 0xff;
+            len += 2;
+
+            lit = 0;
+            lit_pos = op++;
+
+            int end = ip + len;
+            for(ip++; ip < end && ip < in_len - 2; ip++)    // Hash the bytes we skipped over
+                htab[LZ_HASH(in + ip)] = ip;
+            ip = end;
+        }
+        else
+        {
+            if(op >= out_len) return 0;
+            out[op++] = in[ip++];               // Copy literal
+            if(++lit == LZ_MAX_LIT)             // Literal run is full, start a new one
+            {
+                out[lit_pos] = lit - 1;
+                lit = 0;
+                if(op >= out_len) return 0;
+                lit_pos = op++;
+            }
+        }
+    }
+
+    if(lit) out[lit_pos] = lit - 1;
+    else op--;
+    return op;
+}
+
+// Decompresses in_len bytes into out, returns decompressed length or -1 if the data is corrupt
+static int lz_decompress(const unsigned char* in, int in_len, unsigned char* out, int out_len)
+{
+    int ip = 0, op = 0;
+
+    while(ip < in_len)
+    {
+        unsigned ctrl = in[ip++];
+        if(ctrl < LZ_MAX_LIT)                   // Literal run
+        {
+            int len = ctrl + 1;
+            if(ip + len > in_len || op + len > out_len) return -1;
+            memcpy(out + op, in + ip, len);
+            ip += len;
+            op += len;
+        }
+        else                                    // Back reference
+        {
+            int len = ctrl >> 5;
+            if(len == 7)
+            {
+                if(ip >= in_len) return -1;
+                len += in[ip++];
+            }
+            if(ip >= in_len) return -1;
+            int ref = op - ((ctrl & 0x1f) << 8) - in[ip++] - 1;
+            len += 2;
+            if(ref < 0 || op + len > out_len) return -1;
+            while(len--) out[op++] = out[ref++];    // Byte by byte, the match may overlap itself
+        }
+    }
+    return op;
+}
+
+// Looks up a decompressed run in the cache, copies it to data if found
+static int run_cache_get(long nFileBlock, int nRun, char* data)
+{
+    struct cs1550_run_cache_slot* slot = &run_cache[(nFileBlock * 7 + nRun) % RUN_CACHE_SLOTS];
+    int hit;
+
+    pthread_mutex_lock(&run_cache_lock);
+    hit = slot->nFileBlock == nFileBlock && slot->nRun == nRun;
+    if(hit) memcpy(data, slot->data, RUN_SIZE);
+    pthread_mutex_unlock(&run_cache_lock);
+    return hit;
+}
+
+// Stores a decompressed run in the cache
+static void run_cache_put(long nFileBlock, int nRun, const char* data)
+{
+    struct cs1550_run_cache_slot* slot = &run_cache[(nFileBlock * 7 + nRun) % RUN_CACHE_SLOTS];
+
+    pthread_mutex_lock(&run_cache_lock);
+    slot->nFileBlock = nFileBlock;
+    slot->nRun = nRun;
+    memcpy(slot->data, data, RUN_SIZE);
+    pthread_mutex_unlock(&run_cache_lock);
+}
+
+// Drops every cached run of a file
+static void run_cache_invalidate(long nFileBlock)
+{
+    int i;
+
+    pthread_mutex_lock(&run_cache_lock);
+    for(i = 0; i < RUN_CACHE_SLOTS; i++)
+    {
+        if(run_cache[i].nFileBlock == nFileBlock) run_cache[i].nFileBlock = 0;
+    }
+    pthread_mutex_unlock(&run_cache_lock);
+}
+
+// Follows a FAT chain n blocks on from index k
+static int chain_walk(short* fat, int k, int n)
+{
+    while(n-- > 0 && k >= 0)
+        k = fat[k];
+    return k;
+}
+
+// Counts the logical blocks run i spans
+static int run_blocks(cs1550_run_map* map, int i)
+{
+    if(map->nFlags & MAP_NOCOMPRESS) return map->runs[i].nLength / MAX_DATA_IN_BLOCK;
+    return RUN_BLOCKS;
+}
+
+// Finds the run covering logical block b, -1 if b is in a hole
+static int find_run(cs1550_run_map* map, int b)
+{
+    int i;
+    for(i = 0; i < map->nRuns && map->runs[i].nFirst <= b; i++)
+    {
+        if(b < map->runs[i].nFirst + run_blocks(map, i)) return i;
+    }
+    return -1;
+}
+
+// Adds an empty run starting at logical block b, taking another map block from
+// the FAT if the ones the map has are full. Returns its index, -1 if the disk is full.
+static int insert_run(short* fat, cs1550_run_map* map, int b)
+{
+    int i = map->nRuns;
+
+    if(map->nRuns == MAX_RUNS) return -1;
+    if(map->nRuns == map->nBlocks * MAX_RUNS_IN_MAP)    // Map needs one more block
+    {
+        int k = find_empty_fat_index(fat);
+        if(k == -1) return -1;
+        fat[k] = -1;
+        map->nBlock[map->nBlocks++] = START_FILES + k;
+    }
+    while(i > 0 && map->runs[i - 1].nFirst > b)         // Keep the map sorted
+    {
+        map->runs[i] = map->runs[i - 1];
+        i--;
+    }
+    map->runs[i].nFirst = b;
+    map->runs[i].nStartBlock = -1;
+    map->runs[i].nLength = 0;
+    map->runs[i].nStored = 0;
+    map->nRuns++;
+    return i;
+}
+
+// Removes run i from the map and frees its blocks, leaving a hole
+static void remove_run(short* fat, cs1550_run_map* map, int i)
+{
+    free_chain(fat, map->runs[i].nStartBlock);
+    map->nRuns--;
+    memmove(&map->runs[i], &map->runs[i + 1], (map->nRuns - i) * sizeof(struct cs1550_run));
+
+    while(map->nBlocks > 1 && map->nRuns <= (map->nBlocks - 1) * MAX_RUNS_IN_MAP)
+        fat[map->nBlock[--map->nBlocks] - START_FILES] = 0;    // Give back map blocks we no longer need
+}
+
+// Loads a compressed run into data (RUN_SIZE bytes, zero filled past the run's length)
+static int load_run(short* fat, struct cs1550_run* run, long nFileBlock, char* data)
+{
+    unsigned char stored[RUN_SIZE];
+    int nRun = run->nFirst / RUN_BLOCKS;
+    int bytes = 0;
+    int k = run->nStartBlock;
+
+    if(run_cache_get(nFileBlock, nRun, data)) return 0; // Already decompressed
+
+    memset(data, 0, RUN_SIZE);
+    while(bytes < run->nStored)                         // Read every block of the run
+    {
+        if(k < 0) return -EIO;                              // Chain is shorter than the run
+        int n = run->nStored - bytes;
+        if(n > MAX_DATA_IN_BLOCK) n = MAX_DATA_IN_BLOCK;
+        cs1550_disk_block* block = load_block(START_FILES + k);
+        memcpy(stored + bytes, block->data, n);
+        free(block);
+        bytes += n;
+        k = fat[k];
+    }
+
+    if(run->nStored == run->nLength)                    // Stored uncompressed
+        memcpy(data, stored, run->nLength);
+    else if(lz_decompress(stored, run->nStored, (unsigned char*) data, RUN_SIZE) != run->nLength)
+        return -EIO;
+
+    run_cache_put(nFileBlock, nRun, data);
+    return 0;
+}
+
+// Compresses length bytes of data and stores them as the run starting at logical
+// block nFirst, replacing its old blocks. A run of nothing but zeros becomes a hole.
+static int store_run(short* fat, cs1550_run_map* map, long nFileBlock, int nFirst, const char* data, int length)
+{
+    int r = find_run(map, nFirst);
+    unsigned char packed[RUN_SIZE];
+    const char* stored = data;
+    int nStored = length;
+    int nBlocks = (length + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+    int bytes = 0, prev = -1;
+    int i;
+
+    for(i = 0; i < length && data[i] == 0; i++);       // Look for any data at all
+    if(i == length)                                     // All zeros, don't keep anything
+    {
+        if(r >= 0) remove_run(fat, map, r);
+        return 0;
+    }
+
+    // Only keep the compressed form if it saves at least one block
+    int n = 0;
+    if(nBlocks > 1)
+        n = lz_compress((const unsigned char*) data, length, packed, (nBlocks - 1) * MAX_DATA_IN_BLOCK);
+    if(n > 0)
+    {
+        stored = (const char*) packed;
+        nStored = n;
+        nBlocks = (n + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+    }
+
+    if(r < 0 && (r = insert_run(fat, map, nFirst)) < 0)
+        return -ENOSPC;                                 // No block left for the map to grow into
+    struct cs1550_run* run = &map->runs[r];
+
+    if(nBlocks > count_empty_fat_indexes(fat) + chain_length(fat, run->nStartBlock))
+    {
+        if(run->nStartBlock < 0) remove_run(fat, map, r);  // Drop the run we just added
+        return -ENOSPC;                                 // Leave the old run alone
+    }
+
+    free_chain(fat, run->nStartBlock);
+    run->nStartBlock = -1;
+
+    cs1550_disk_block* block = malloc(sizeof(cs1550_disk_block));
+    while(bytes < nStored)                              // Write to as many blocks as necessary
+    {
+        int k = find_empty_fat_index(fat);
+        fat[k] = -1;                                        // Set current block as EOF
+        if(prev == -1) run->nStartBlock = k;
+        else fat[prev] = k;
+
+        n = nStored - bytes;
+        if(n > MAX_DATA_IN_BLOCK) n = MAX_DATA_IN_BLOCK;
+        memset(block, 0, sizeof(cs1550_disk_block));
+        memcpy(block->data, stored + bytes, n);
+        save_block(block, START_FILES + k);
+
+        prev = k;
+        bytes += n;
+    }
+    free(block);
+
+    run->nLength = length;
+    run->nStored = nStored;
+    run_cache_put(nFileBlock, nFirst / RUN_BLOCKS, data);  // Keep the cache in step with the disk
+    return 0;
+}
+
+// Writes n bytes at start into logical block b of an uncompressed map. Existing
+// blocks are updated in place; a new block is only allocated if it would hold
+// something other than zeros, and joins the run next to it when it can.
+static int write_block(short* fat, cs1550_run_map* map, int b, int start, const char* buf, int n)
+{
+    int i = find_run(map, b);
+    cs1550_disk_block* block;
+    int j, k;
+
+    if(i >= 0)                                          // Block exists, update it in place
+    {
+        k = chain_walk(fat, map->runs[i].nStartBlock, b - map->runs[i].nFirst);
+        if(k < 0) return -EIO;
+        if(n < MAX_DATA_IN_BLOCK) block = load_block(START_FILES + k);   // Keep the bytes around the write
+        else block = calloc(1, sizeof(cs1550_disk_block));
+        memcpy(block->data + start, buf, n);
+        save_block(block, START_FILES + k);
+        free(block);
+        return 0;
+    }
+
+    for(j = 0; j < n && buf[j] == 0; j++);             // Look for any data at all
+    if(j == n) return 0;                                // Nothing but zeros, stays a hole
+
+    k = find_empty_fat_index(fat);
+    if(k == -1) return -ENOSPC;
+    fat[k] = -1;                                        // Set new block as EOF
+
+    if(b > 0 && (i = find_run(map, b - 1)) >= 0 && run_blocks(map, i) < MAX_EXTENT_BLOCKS)
+    {
+        struct cs1550_run* run = &map->runs[i];             // Append to the run ending just before b
+        fat[chain_walk(fat, run->nStartBlock, run_blocks(map, i) - 1)] = k;
+        run->nLength += MAX_DATA_IN_BLOCK;
+        run->nStored += MAX_DATA_IN_BLOCK;
+    }
+    else if((i = find_run(map, b + 1)) >= 0 && run_blocks(map, i) < MAX_EXTENT_BLOCKS)
+    {
+        struct cs1550_run* run = &map->runs[i];             // Prepend to the run starting just after b
+        fat[k] = run->nStartBlock;
+        run->nStartBlock = k;
+        run->nFirst = b;
+        run->nLength += MAX_DATA_IN_BLOCK;
+        run->nStored += MAX_DATA_IN_BLOCK;
+    }
+    else if((i = insert_run(fat, map, b)) >= 0)         // Start a run of its own
+    {
+        map->runs[i].nStartBlock = k;
+        map->runs[i].nLength = MAX_DATA_IN_BLOCK;
+        map->runs[i].nStored = MAX_DATA_IN_BLOCK;
+    }
+    else
+    {
+        fat[k] = 0;                                         // No block left for the map, give this one back
+        return -ENOSPC;
+    }
+
+    block = calloc(1, sizeof(cs1550_disk_block));
+    memcpy(block->data + start, buf, n);
+    save_block(block, START_FILES + k);
+    free(block);
+    return 0;
+}
+
+// Frees logical block b of run i in an uncompressed map, splitting the run if b
+// is in its middle. Returns -1 if that split needs a new map block and the disk is full.
+static int drop_block(short* fat, cs1550_run_map* map, int i, int b)
+{
+    struct cs1550_run* run = &map->runs[i];
+    int blocks = run_blocks(map, i);
+    int off = b - run->nFirst;
+    int j, k, prev;
+
+    if(blocks == 1)                                     // Whole run goes
+    {
+        remove_run(fat, map, i);
+        return 0;
+    }
+
+    if(off == 0)                                        // First block
+    {
+        k = run->nStartBlock;
+        run->nStartBlock = fat[k];
+        fat[k] = 0;
+        run->nFirst++;
+    }
+    else if(off == blocks - 1)                          // Last block
+    {
+        prev = chain_walk(fat, run->nStartBlock, off - 1);
+        fat[fat[prev]] = 0;
+        fat[prev] = -1;
+    }
+    else                                                // Middle block, the rest becomes a new run
+    {
+        if((j = insert_run(fat, map, b + 1)) < 0) return -1;
+        run = &map->runs[i];                                // Sorted insert lands after i
+        prev = chain_walk(fat, run->nStartBlock, off - 1);
+        k = fat[prev];
+        map->runs[j].nStartBlock = fat[k];
+        map->runs[j].nLength = (blocks - off - 1) * MAX_DATA_IN_BLOCK;
+        map->runs[j].nStored = map->runs[j].nLength;
+        fat[prev] = -1;
+        fat[k] = 0;
+        run->nLength = off * MAX_DATA_IN_BLOCK;
+        run->nStored = run->nLength;
+        return 0;
+    }
+
+    run->nLength -= MAX_DATA_IN_BLOCK;
+    run->nStored -= MAX_DATA_IN_BLOCK;
+    return 0;
+}
+
+// Zeros n bytes at start in logical block b of an uncompressed map, if the block exists
+static int zero_block(short* fat, cs1550_run_map* map, int b, int start, int n)
+{
+    int i = find_run(map, b);
+    if(i < 0) return 0;                                 // Already a hole
+
+    int k = chain_walk(fat, map->runs[i].nStartBlock, b - map->runs[i].nFirst);
+    if(k < 0) return -EIO;
+    cs1550_disk_block* block = load_block(START_FILES + k);
+    memset(block->data + start, 0, n);
+    save_block(block, START_FILES + k);
+    free(block);
+    return 0;
+}
+
+// Reads from a mapped file. Compressed maps decompress only the runs that cover
+// the request, uncompressed maps read just the blocks. Holes read as zeros without I/O.
+static int read_mapped(cs1550_directory_entry* dir, int fileIndex, char* buf, size_t size, off_t offset)
+{
+    long nFileBlock = dir->files[fileIndex].nStartBlock;
+    size_t fsize = dir->files[fileIndex].fsize;
+    char data[RUN_SIZE];
+    size_t pos = offset;
+    int res = 0;
+
+    if(offset >= fsize) return 0;                       // Nothing past EOF
+    if(size > fsize - offset) size = fsize - offset;
+
+    cs1550_run_map* map = load_map(nFileBlock);
+    short* fat = load_fat();
+    int plain = map->nFlags & MAP_NOCOMPRESS;
+    size_t unit = plain ? MAX_DATA_IN_BLOCK : RUN_SIZE;
+
+    while(pos < offset + size)
+    {
+        size_t start = pos % unit;
+        size_t n = unit - start;
+        if(n > offset + size - pos) n = offset + size - pos;
+        int i = find_run(map, pos / MAX_DATA_IN_BLOCK);
+
+        if(i < 0)                                           // Hole
+            memset(buf + (pos - offset), 0, n);
+        else if(plain)                                      // Block of an extent
+        {
+            int k = chain_walk(fat, map->runs[i].nStartBlock, pos / MAX_DATA_IN_BLOCK - map->runs[i].nFirst);
+            if(k < 0)
+            {
+                res = -EIO;
+                break;
+            }
+            cs1550_disk_block* block = load_block(START_FILES + k);
+            memcpy(buf + (pos - offset), block->data + start, n);
+            free(block);
+        }
+        else                                                // Compressed run
+        {
+            if((res = load_run(fat, &map->runs[i], nFileBlock, data)) != 0)
+                break;
+            memcpy(buf + (pos - offset), data + start, n);
+        }
+        pos += n;
+    }
+
+    free(fat);
+    free(map);
+    return res ? res : (int) size;
+}
+
+// Writes to a mapped file. Compressed maps recompress only the runs the write
+// touches, uncompressed maps update blocks in place. Skipped-over space stays a hole.
+static int write_mapped(cs1550_directory_entry* dir, int fileIndex, const char* buf, size_t size, off_t offset)
+{
+    long nFileBlock = dir->files[fileIndex].nStartBlock;
+    char data[RUN_SIZE];
+    size_t pos = offset;
+    int res = 0;
+
+    cs1550_run_map* map = load_map(nFileBlock);
+    short* fat = load_fat();
+    int plain = map->nFlags & MAP_NOCOMPRESS;
+    size_t unit = plain ? MAX_DATA_IN_BLOCK : RUN_SIZE;
+
+    while(pos < offset + size)
+    {
+        int u = pos / unit;
+        size_t start = pos % unit;
+        size_t n = unit - start;
+        if(n > offset + size - pos) n = offset + size - pos;
+
+        if(plain)
+            res = write_block(fat, map, u, start, buf + (pos - offset), n);
+        else
+        {
+            int i = find_run(map, u * RUN_BLOCKS);
+            int length = 0;
+            if(i >= 0 && (res = load_run(fat, &map->runs[i], nFileBlock, data)) != 0)
+                break;
+            if(i >= 0) length = map->runs[i].nLength;
+            else memset(data, 0, RUN_SIZE);
+            memcpy(data + start, buf + (pos - offset), n);
+            if(start + n > length) length = start + n;
+            res = store_run(fat, map, nFileBlock, u * RUN_BLOCKS, data, length);
+        }
+        if(res != 0)
+            break;
+        pos += n;
+    }
+
+    if(pos > dir->files[fileIndex].fsize)
+        dir->files[fileIndex].fsize = pos;              // Set file size
+
+    save_map(map, nFileBlock);
+    save_fat(fat);
+
+    free(fat);
+    free(map);
+    return pos > offset ? (int) (pos - offset) : res;   // Report a short write if we ran out of space
+}
+
+// Shrinks or grows a mapped file to size bytes
+static int truncate_mapped(cs1550_directory_entry* dir, int fileIndex, size_t size)
+{
+    long nFileBlock = dir->files[fileIndex].nStartBlock;
+    char data[RUN_SIZE];
+    int res = 0;
+    int i;
+
+    if(size >= dir->files[fileIndex].fsize)             // Growing just leaves a hole
+    {
+        dir->files[fileIndex].fsize = size;
+        return 0;
+    }
+
+    cs1550_run_map* map = load_map(nFileBlock);
+    short* fat = load_fat();
+
+    run_cache_invalidate(nFileBlock);                   // Cut runs must not come back from the cache
+    if(map->nFlags & MAP_NOCOMPRESS)
+    {
+        int keep = (size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+        for(i = map->nRuns - 1; i >= 0; i--)                // Free blocks past the new EOF
+        {
+            struct cs1550_run* run = &map->runs[i];
+            if(run->nFirst >= keep)
+                remove_run(fat, map, i);
+            else if(run->nFirst + run_blocks(map, i) > keep)
+            {
+                int k = chain_walk(fat, run->nStartBlock, keep - run->nFirst - 1);
+                free_chain(fat, fat[k]);
+                fat[k] = -1;
+                run->nLength = (keep - run->nFirst) * MAX_DATA_IN_BLOCK;
+                run->nStored = run->nLength;
+            }
+        }
+        if(size % MAX_DATA_IN_BLOCK)                        // Zero the tail so growing again reads zeros
+            res = zero_block(fat, map, keep - 1, size % MAX_DATA_IN_BLOCK,
+                             MAX_DATA_IN_BLOCK - size % MAX_DATA_IN_BLOCK);
+    }
+    else
+    {
+        int keep = (size + RUN_SIZE - 1) / RUN_SIZE;
+        for(i = map->nRuns - 1; i >= 0 && map->runs[i].nFirst >= keep * RUN_BLOCKS; i--)
+            remove_run(fat, map, i);                        // Free runs past the new EOF
+
+        size_t length = size % RUN_SIZE;
+        i = keep > 0 ? find_run(map, (keep - 1) * RUN_BLOCKS) : -1;
+        if(i >= 0 && length > 0 && length < map->runs[i].nLength)     // Cut the last run short
+        {
+            if((res = load_run(fat, &map->runs[i], nFileBlock, data)) == 0)
+            {
+                memset(data + length, 0, RUN_SIZE - length);
+                res = store_run(fat, map, nFileBlock, (keep - 1) * RUN_BLOCKS, data, length);
+            }
+        }
+    }
+
+    if(res == 0)
+    {
+        dir->files[fileIndex].fsize = size;
+        save_map(map, nFileBlock);
+        save_fat(fat);
+    }
+
+    free(fat);
+    free(map);
+    return res;
+}
+
+// Reads from a plain file by walking its FAT chain to the block holding offset
+static int read_raw(cs1550_directory_entry* dir, int fileIndex, char* buf, size_t size, off_t offset)
+{
+    size_t fsize = dir->files[fileIndex].fsize;
+    int k = dir->files[fileIndex].nStartBlock - START_FILES;
+    size_t pos = offset;
+    int res = 0;
+    int b;
+
+    if(offset >= fsize) return 0;                       // Nothing past EOF
+    if(size > fsize - offset) size = fsize - offset;
+
+    short* fat = load_fat();
+
+    for(b = 0; b < offset / MAX_DATA_IN_BLOCK && k >= 0; b++)  // Move to desired offset
+        k = fat[k];
+
+    while(pos < offset + size)
+    {
+        if(k < 0)                                           // Chain is shorter than the file
+        {
+            res = -EIO;
+            break;
+        }
+        size_t start = pos % MAX_DATA_IN_BLOCK;
+        size_t n = MAX_DATA_IN_BLOCK - start;
+        if(n > offset + size - pos) n = offset + size - pos;
+
+        cs1550_disk_block* block = load_block(START_FILES + k);
+        memcpy(buf + (pos - offset), block->data + start, n);
+        free(block);
+
+        pos += n;
+        k = fat[k];
+    }
+
+    free(fat);
+    return res ? res : (int) size;
+}
+
+// Returns the block after k in a chain, appending a new one if k is the last
+static int next_block(short* fat, int k)
+{
+    if(fat[k] == -1)                        // At EOF
+    {
+        int a = find_empty_fat_index(fat);      // Find next empty FAT entry for new file block
+        fat[a] = -1;                            // Set new block as EOF
+        fat[k] = a;                             // Set old EOF to new block
+    }
+    return fat[k];
+}
+
+// Writes to a plain file in place, only rewriting the blocks that overlap the write
+static int write_raw(cs1550_directory_entry* dir, int fileIndex, const char* buf, size_t size, off_t offset)
+{
+    size_t fsize = dir->files[fileIndex].fsize;
+    int k = dir->files[fileIndex].nStartBlock - START_FILES;
+    size_t pos = offset;
+    int b;
+
+    short* fat = load_fat();
+
+    int nBlocks = (offset + size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+    if(nBlocks - chain_length(fat, k) > count_empty_fat_indexes(fat))
+    {
+        free(fat);
+        return -ENOSPC;
+    }
+
+    for(b = 0; b < offset / MAX_DATA_IN_BLOCK; b++)     // Move to desired offset
+        k = next_block(fat, k);
+
+    while(pos < offset + size)
+    {
+        size_t start = pos % MAX_DATA_IN_BLOCK;
+        size_t n = MAX_DATA_IN_BLOCK - start;
+        if(n > offset + size - pos) n = offset + size - pos;
+
+        cs1550_disk_block* block;
+        if(n < MAX_DATA_IN_BLOCK && pos - start < fsize)    // Partial block, keep the bytes around the write
+            block = load_block(START_FILES + k);
+        else
+            block = calloc(1, sizeof(cs1550_disk_block));
+
+        memcpy(block->data + start, buf + (pos - offset), n);
+        save_block(block, START_FILES + k);
+        free(block);
+
+        pos += n;
+        if(pos < offset + size) k = next_block(fat, k);
+    }
+
+    if(pos > fsize)
+        dir->files[fileIndex].fsize = pos;              // Set file size
+
+    save_fat(fat);
+    free(fat);
+    return size;
+}
+
+// Shrinks a plain file to size bytes
+static int truncate_raw(cs1550_directory_entry* dir, int fileIndex, size_t size)
+{
+    int k = dir->files[fileIndex].nStartBlock - START_FILES;
+    int b;
+
+    short* fat = load_fat();
+
+    for(b = 1; b < (size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK; b++)   // Keep at least the first block
+        k = fat[k];
+    free_chain(fat, fat[k]);                            // Free everything after the new last block
+    fat[k] = -1;
+    dir->files[fileIndex].fsize = size;
+
+    save_fat(fat);
+    free(fat);
+    return 0;
+}
+
+// Moves a plain file into an uncompressed run map so it can hold holes. The
+// file's chain is kept as is and cut into runs; only its first block moves,
+// since that block becomes the run map.
+static int convert_to_map(cs1550_directory_entry* dir, int fileIndex)
+{
+    long nFileBlock = dir->files[fileIndex].nStartBlock;
+    size_t fsize = dir->files[fileIndex].fsize;
+    int k = nFileBlock - START_FILES;
+    int blocks = (fsize + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+    int b = 0;
+
+    short* fat = load_fat();
+    cs1550_run_map* map = calloc(1, sizeof(cs1550_run_map));
+    map->nFlags = MAP_NOCOMPRESS;
+    map->nBlocks = 1;
+
+    if(blocks > 0)
+    {
+        int first = find_empty_fat_index(fat);
+        if(first == -1)
+        {
+            free(map);
+            free(fat);
+            return -ENOSPC;
+        }
+
+        cs1550_disk_block* block = load_block(START_FILES + k);    // Move the first block's data
+        save_block(block, START_FILES + first);
+        free(block);
+        fat[first] = fat[k];
+        fat[k] = -1;
+
+        if(fsize % MAX_DATA_IN_BLOCK)                           // Zero past EOF so a later hole reads zeros
+        {
+            int last = START_FILES + chain_walk(fat, first, blocks - 1);
+            block = load_block(last);
+            memset(block->data + fsize % MAX_DATA_IN_BLOCK, 0, MAX_DATA_IN_BLOCK - fsize % MAX_DATA_IN_BLOCK);
+            save_block(block, last);
+            free(block);
+        }
+
+        while(b < blocks)                                       // Cut the chain into runs
+        {
+            int n = blocks - b;
+            if(n > MAX_EXTENT_BLOCKS) n = MAX_EXTENT_BLOCKS;
+            int i = insert_run(fat, map, b);
+            if(i < 0)                                               // No block left to grow the map into
+            {
+                free(map);
+                free(fat);
+                return -ENOSPC;
+            }
+            int last = chain_walk(fat, first, n - 1);
+
+            map->runs[i].nStartBlock = first;
+            map->runs[i].nLength = n * MAX_DATA_IN_BLOCK;
+            map->runs[i].nStored = map->runs[i].nLength;
+            first = fat[last];
+            fat[last] = -1;
+            b += n;
+        }
+    }
+
+    run_cache_invalidate(nFileBlock);
+    save_map(map, nFileBlock);
+    save_fat(fat);
+    set_mapped(dir, fileIndex, 1);
+
+    free(map);
+    free(fat);
+    return 0;
+}
+
+// Zeros length bytes of a mapped file at offset, freeing every block (or
+// compressed run) that ends up empty
+static int punch_hole(cs1550_directory_entry* dir, int fileIndex, off_t offset, off_t length)
+{
+    long nFileBlock = dir->files[fileIndex].nStartBlock;
+    size_t end = offset + length;
+    size_t pos = offset;
+    char data[RUN_SIZE];
+    int res = 0;
+
+    if(end > dir->files[fileIndex].fsize) end = dir->files[fileIndex].fsize;
+
+    cs1550_run_map* map = load_map(nFileBlock);
+    short* fat = load_fat();
+    int plain = map->nFlags & MAP_NOCOMPRESS;
+    size_t unit = plain ? MAX_DATA_IN_BLOCK : RUN_SIZE;
+
+    while(pos < end)
+    {
+        int u = pos / unit;
+        size_t start = pos % unit;
+        size_t n = unit - start;
+        if(n > end - pos) n = end - pos;
+        int i = find_run(map, plain ? u : u * RUN_BLOCKS);
+
+        if(i >= 0 && plain)
+        {
+            if(n < MAX_DATA_IN_BLOCK || drop_block(fat, map, i, u) != 0)
+                res = zero_block(fat, map, u, start, n);        // Partial block, or no room to split the run
+        }
+        else if(i >= 0 && start == 0 && n >= map->runs[i].nLength)     // Whole run goes
+            remove_run(fat, map, i);
+        else if(i >= 0 && (res = load_run(fat, &map->runs[i], nFileBlock, data)) == 0)
+        {
+            memset(data + start, 0, n);
+            res = store_run(fat, map, nFileBlock, u * RUN_BLOCKS, data, map->runs[i].nLength);
+        }
+        if(res != 0)
+            break;
+        pos += n;
+    }
+
+    save_map(map, nFileBlock);
+    save_fat(fat);
+
+    free(fat);
+    free(map);
+    return res;
+}
+
+// Counts the blocks a file occupies on disk
+static long file_blocks(cs1550_directory_entry* dir, int fileIndex)
+{
+    long n;
+    int r;
+
+    if(!is_mapped(dir, fileIndex))
+    {
+        n = (dir->files[fileIndex].fsize + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+        return n > 0 ? n : 1;
+    }
+
+    cs1550_run_map* map = load_map(dir->files[fileIndex].nStartBlock);
+    n = map->nBlocks;                                   // Run map blocks
+    for(r = 0; r < map->nRuns; r++)
+        n += (map->runs[r].nStored + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+    free(map);
+    return n;
+}
+
+// Loads the directory holding a file, returns the file's index in it or -ENOENT
+static int load_file(char* directory, char* filename, char* extension, cs1550_directory_entry** dir, long* nDirBlock)
+{
+    cs1550_root_directory* root = load_root();
+    int dirIndex = find_dir(root, directory);
+    int fileIndex = -ENOENT;
+
+    *dir = NULL;
+    if(dirIndex != -1)
+    {
+        *nDirBlock = root->directories[dirIndex].nStartBlock;
+        *dir = load_dir(*nDirBlock);
+        fileIndex = find_file(*dir, filename, extension);
+        if(fileIndex == -1) fileIndex = -ENOENT;
+    }
+    free(root);
+    return fileIndex;
+}
+
+// Records that a file's contents changed
+static void bump_generation(long nStartBlock)
+{
+    pthread_mutex_lock(&generation_lock);
+    file_generation[nStartBlock - START_FILES]++;
+    pthread_mutex_unlock(&generation_lock);
+}
+
+// Checks whether a file is unchanged since it was last opened, and remembers its current generation
+static int same_generation(long nStartBlock)
+{
+    int same;
+
+    pthread_mutex_lock(&generation_lock);
+    same = open_generation[nStartBlock - START_FILES] == file_generation[nStartBlock - START_FILES];
+    open_generation[nStartBlock - START_FILES] = file_generation[nStartBlock - START_FILES];
+    pthread_mutex_unlock(&generation_lock);
+    return same;
+}
+
 // Splits up path into each of it's separate components (directory, filename, extension)
 static int parse_path(const char* path, char* directory, char* filename, char* extension)
 {
@@ -288,6 +1457,7 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
             stbuf->st_mode = S_IFREG | 0666;
             stbuf->st_nlink = 1;
             stbuf->st_size = dir->files[fileIndex].fsize;
+            stbuf->st_blocks = file_blocks(dir, fileIndex) * BLOCK_SIZE / 512;    // Holes and compression take less
         }
         else
         {
@@ -450,6 +1620,9 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
             strcpy(dir->files[dir->nFiles].fext, extension);
             dir->files[dir->nFiles].fsize = 0;
             dir->files[dir->nFiles].nStartBlock = fat_index + START_FILES;      // Set new starting point
+            set_mapped(dir, dir->nFiles, compress_dir(directory));
+            if(is_mapped(dir, dir->nFiles))                                 // Compressed files start with an empty run map
+                init_map(fat_index + START_FILES, 0);
             dir->nFiles++;
 
             save_fat(fat);                                                      // Save fat back to disk
@@ -479,10 +1652,7 @@ static int cs1550_unlink(const char *path)
 static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 			  struct fuse_file_info *fi)
 {
-	(void) buf;
-	(void) offset;
 	(void) fi;
-	(void) path;
 
     char directory[MAX_FILENAME + 1];
     char filename[MAX_FILENAME + 1];
@@ -490,52 +1660,20 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
     int path_type = parse_path(path, directory, filename, extension);
 
     if(path_type == PATH_DIR) return -EISDIR;   // If path is a directory, return error
-    else if(offset > size)    return -1;        // Else if desired offset greater than size of our file, return error
-    else if(path_type == PATH_FILE && size > 0) // Else if path is a file with stuff in it
-    {
-        cs1550_root_directory* root = load_root();                                  // Load root
-        int nStartBlock = root->directories[find_dir(root, directory)].nStartBlock; // Find file directory
-        cs1550_directory_entry* dir = load_dir(nStartBlock);                        // Load directory
-        int fileIndex = find_file(dir, filename, extension);                        // Find file in directory
-        int file_nStartBlock = dir->files[fileIndex].nStartBlock;                   // Go to first block of file
-
-        int a = file_nStartBlock;
-        int b = START_FILES;
-        int fat_index = a - b;          // No clue why this works, but i don't care :)
-
-        size = dir->files[fileIndex].fsize; // Get file size
+    if(path_type != PATH_FILE) return -ENOENT;  // Else if path isn't a file, return error
 
-        cs1550_disk_block* block = load_block(dir->files[fileIndex].nStartBlock);   // Load first block of file
-
-        short* fat = load_fat();                                                    // Load FAT
-
-        int k = fat_index;
-        while(offset >= MAX_DATA_IN_BLOCK)      // Move to desired offset
-        {
-            k = fat[k];
-            offset -= MAX_DATA_IN_BLOCK;
-        }
+    cs1550_directory_entry* dir;
+    long nStartBlock;
+    int fileIndex = load_file(directory, filename, extension, &dir, &nStartBlock);
+    int res = fileIndex;
 
-        block = load_block(START_FILES + k);    // Load the block (includes the offset)
-        strcpy(buf, block->data + offset);      // Start writing the offset data to the buffer
-
-        while(fat[k] != -1) // Write the rest of the data to buffer
-        {
-            k = fat[k];
-            block = load_block(START_FILES + k);
-            strcat(buf, block->data);
-        }
-
-
-        free(fat);      // Deallocate FAT
-        free(block);    // " block
-        free(dir);      // " subdirectory
-        free(root);     // " root directory
-    }
-    else return -1;     // Else return error
+    if(fileIndex >= 0 && is_mapped(dir, fileIndex))     // Mapped files read through their run map
+        res = read_mapped(dir, fileIndex, buf, size, offset);
+    else if(fileIndex >= 0)                                 // Else read straight from the FAT chain
+        res = read_raw(dir, fileIndex, buf, size, offset);
 
-
-	return size;        // Return size
+    free(dir);      // Deallocate subdirectory
+    return res;     // Return bytes read
 }
 
 /* 
@@ -545,130 +1683,156 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 static int cs1550_write(const char *path, const char *buf, size_t size, 
 			  off_t offset, struct fuse_file_info *fi)
 {
-	(void) buf;
-    (void) offset;
     (void) fi;
-    (void) path;
 
     char directory[MAX_FILENAME + 1];
     char filename[MAX_FILENAME + 1];
     char extension[MAX_EXTENSION + 1];
     int path_type = parse_path(path, directory, filename, extension);
 
-    if(path_type == PATH_FILE && size > 0) // If path exists
-    {
-        if(offset <= size) // If offset within bounds of file
-        { 
-            // See identical code in cs1550_read for detailed comments
-            cs1550_root_directory* root = load_root();
-            int nStartBlock = root->directories[find_dir(root, directory)].nStartBlock;
-            cs1550_directory_entry* dir = load_dir(nStartBlock);
-            int fileIndex = find_file(dir, filename, extension);
-            int file_nStartBlock = dir->files[fileIndex].nStartBlock;
-
-            int a = file_nStartBlock;
-            int b = START_FILES;
-            int fat_index = a - b;          // Still don't know why this works
-
-            short* fat = load_fat();        // Load FAT
-
-            if(offset == size) // If offset at EOF
-            {
-                while(fat[fat_index] != -1)         // While not at EOF
-                {
-                    fat_index = fat[fat_index];
-                }
-                int a = find_empty_fat_index(fat);  // Find next empty FAT entry for new file block
-                fat[fat_index] = a;                 // Set old EOF to new block
-                fat_index = a;                      // Set fat index to new block so we'll write to it
-            }
-            else              // Else it isn't at the end of the file
-            {
-                int reset = fat[fat_index];     // Get ready to nuke the current block
-                int temp;
-                while(reset != -1)              // While not at EOF
-                {
-                    temp = fat[reset];              // Save index of next block
-                    fat[reset] = 0;                 // Set current block to unused
-                    reset = temp;                   // Move to next block
-                }
-            }
+    if(path_type == PATH_DIR) return -EISDIR;   // If path is a directory, return error
+    if(path_type != PATH_FILE) return -ENOENT;  // Else if path isn't a file, return error
+    if(size == 0) return 0;                     // Nothing to do
+    if(offset + size > MAX_MAPPED_SIZE) return -EFBIG;     // Past what a run map can address
+
+    cs1550_directory_entry* dir;
+    long nStartBlock;
+    int fileIndex = load_file(directory, filename, extension, &dir, &nStartBlock);
+    int res = fileIndex;
+
+    if(fileIndex >= 0 && offset > dir->files[fileIndex].fsize && !is_mapped(dir, fileIndex))
+        res = convert_to_map(dir, fileIndex);                   // Writing past EOF leaves a hole, which needs a run map
+
+    if(res >= 0 && is_mapped(dir, fileIndex))                   // Mapped files write through their run map
+        res = write_mapped(dir, fileIndex, buf, size, offset);
+    else if(res >= 0)                                           // Else write in place along the FAT chain
+        res = write_raw(dir, fileIndex, buf, size, offset);
+
+    if(res > 0)
+        bump_generation(dir->files[fileIndex].nStartBlock);    // Cached pages of this file are now stale
+    if(fileIndex >= 0)
+        save_dir(dir, nStartBlock);                             // Save new file size
+
+    free(dir);      // Deallocate subdirectory
+    return res;     // Return bytes written
+}
 
-            cs1550_disk_block* block = malloc(sizeof(cs1550_disk_block));   // Allocate space for block
-            strncpy(block->data, buf, MAX_DATA_IN_BLOCK);                   // Copy data to write to block
-            fat[fat_index] = -1;                                            // Set current block as EOF
-            save_block(block, b + fat_index);                               // Save block to disk
+#if FUSE_VERSION >= 29
+/*
+ * Only hole punching is supported. Blocks of runs that end up empty go back
+ * to the allocator, and the file keeps its size.
+ *
+ * lseek SEEK_DATA/SEEK_HOLE is not supported: the FUSE 2 high level API has
+ * no lseek hook, so the kernel reports the whole file as data.
+ */
+static int cs1550_fallocate(const char *path, int mode, off_t offset, off_t length,
+			  struct fuse_file_info *fi)
+{
+    (void) fi;
 
-            if(size > MAX_DATA_IN_BLOCK)                                    // If writing more data than we can to a single block
-            {
-                int bytes = MAX_DATA_IN_BLOCK;
-                int next = fat_index;
-                while(bytes < size)                                             // Write to as many blocks as necessary
-                {
-                    fat[next] = find_empty_fat_index(fat);
-                    memset(block->data, 0, MAX_DATA_IN_BLOCK);                  // Target entire block
-                    strncpy(block->data, buf + bytes, MAX_DATA_IN_BLOCK);       // Copy data to block
-                    save_block(block, START_FILES + fat[next]);                 // Save block to disk
-                    next = fat[next];                                           // Move to next file block
-                    fat[next] = -1;                                             // Set current block as EOF
-                    bytes += MAX_DATA_IN_BLOCK;                                 // Add block to current size of file in bytes
-                }
-            }
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    int path_type = parse_path(path, directory, filename, extension);
 
-            dir->files[fileIndex].fsize = size; // Set file size
+    if(path_type == PATH_DIR) return -EISDIR;
+    if(path_type != PATH_FILE) return -ENOENT;
+    if(mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+    if(offset < 0 || length <= 0) return -EINVAL;
 
-            save_dir(dir, nStartBlock);         // Save subdirectory to disk
+    cs1550_directory_entry* dir;
+    long nStartBlock;
+    int fileIndex = load_file(directory, filename, extension, &dir, &nStartBlock);
+    int res = fileIndex;
 
-            save_fat(fat);                      // Save FAT to disk
+    if(fileIndex >= 0 && offset >= dir->files[fileIndex].fsize)    // Nothing to punch past EOF
+        res = 0;
+    else if(fileIndex >= 0)
+    {
+        if(!is_mapped(dir, fileIndex))
+            res = convert_to_map(dir, fileIndex);                   // Holes need a run map
+        if(res >= 0)
+            res = punch_hole(dir, fileIndex, offset, length);
 
-            free(fat);          // Deallocate FAT
-            free(block);        // " block
-            free(dir);          // " subdirectory
-            free(root);         // " root directory
-        }
-        else return -EFBIG;     // Else requesting to offset outside bounds of file
+        bump_generation(dir->files[fileIndex].nStartBlock);
+        save_dir(dir, nStartBlock);
     }
-    else return -1;         // Else path does not exist
 
-    return size;
+    free(dir);
+    return res;
 }
-
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
+#endif
 
 /*
  * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
+ * existing file is made shorter or longer. Shrinking frees the blocks past
+ * the new end of the file, growing leaves a hole that reads as zeros.
  *
  */
 static int cs1550_truncate(const char *path, off_t size)
 {
-	(void) path;
-	(void) size;
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    int path_type = parse_path(path, directory, filename, extension);
 
-    return 0;
+    if(path_type == PATH_DIR) return -EISDIR;
+    if(path_type != PATH_FILE) return -ENOENT;
+    if(size < 0) return -EINVAL;
+    if(size > MAX_MAPPED_SIZE) return -EFBIG;    // Checked before a plain file is converted
+
+    cs1550_directory_entry* dir;
+    long nStartBlock;
+    int fileIndex = load_file(directory, filename, extension, &dir, &nStartBlock);
+    int res = fileIndex;
+
+    if(fileIndex >= 0 && size > dir->files[fileIndex].fsize && !is_mapped(dir, fileIndex))
+        res = convert_to_map(dir, fileIndex);                   // Growing leaves a hole, which needs a run map
+
+    if(res >= 0 && is_mapped(dir, fileIndex))
+        res = truncate_mapped(dir, fileIndex, size);
+    else if(res >= 0)
+        res = truncate_raw(dir, fileIndex, size);
+
+    if(fileIndex >= 0)                                          // Save whatever size we got to
+    {
+        bump_generation(dir->files[fileIndex].nStartBlock);
+        save_dir(dir, nStartBlock);
+    }
+
+    free(dir);
+    return res;
 }
 
 
 /* 
- * Called when we open a file
+ * Called when we open a file. The kernel may keep the pages it has cached
+ * for the file if nothing has written to it since the last open.
  *
  */
 static int cs1550_open(const char *path, struct fuse_file_info *fi)
 {
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    int path_type = parse_path(path, directory, filename, extension);
+
+    if(path_type == PATH_DIR) return -EISDIR;
+    if(path_type != PATH_FILE) return -ENOENT;
+
+    cs1550_directory_entry* dir;
+    long nStartBlock;
+    int fileIndex = load_file(directory, filename, extension, &dir, &nStartBlock);
+
+    //if we can't find the desired file, return an error
+    if(fileIndex < 0)
+    {
+        free(dir);
+        return fileIndex;
+    }
 
-    //It's not really necessary for this project to anything in open
+    if(same_generation(dir->files[fileIndex].nStartBlock) && config.keep_cache)
+        fi->keep_cache = 1;
 
     /* We're not going to worry about permissions for this project, but 
 	   if we were and we don't have them to the file we should return an error
@@ -676,9 +1840,30 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
         return -EACCES;
     */
 
+    free(dir);
     return 0; //success!
 }
 
+/*
+ * Called once when the filesystem is mounted, to negotiate with the kernel
+ * how it may cache and batch requests. Writeback caching isn't available:
+ * it only exists in libfuse 3, and this file is written against the 2.x API,
+ * so writes still reach us as soon as the kernel gets them.
+ */
+static void* cs1550_init(struct fuse_conn_info *conn)
+{
+	//async reads are left to libfuse, which turns them on unless mounted
+	//with -o sync_read
+
+	//let the kernel send writes bigger than a page
+	conn->want |= FUSE_CAP_BIG_WRITES;
+	conn->max_write = config.io_size;
+	if(conn->max_readahead > config.io_size)
+		conn->max_readahead = config.io_size;
+
+	return NULL;
+}
+
 /*
  * Called when close is called on a file descriptor, but because it might
  * have been dup'ed, this isn't a guarantee we won't ever need the file 
@@ -707,10 +1892,34 @@ static struct fuse_operations hello_oper = {
 	.truncate = cs1550_truncate,
 	.flush = cs1550_flush,
 	.open	= cs1550_open,
+	.init	= cs1550_init,
+#if FUSE_VERSION >= 29
+	.fallocate = cs1550_fallocate,
+#endif
 };
 
-//Don't change this.
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	//pull our own mount options (-o compress, -o compress_dirs=...) out before fuse sees them
+	if(fuse_opt_parse(&args, &config, cs1550_opts, NULL) == -1)
+		return 1;
+
+	if(config.io_size < IO_SIZE_MIN || config.io_size > IO_SIZE_MAX)
+	{
+		fprintf(stderr, "io_size must be between %d and %d\n", IO_SIZE_MIN, IO_SIZE_MAX);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	//max_read has to be given to the kernel at mount time
+	char max_read[32];
+	snprintf(max_read, sizeof(max_read), "-omax_read=%u", config.io_size);
+	fuse_opt_add_arg(&args, max_read);
+
+	res = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }